@@ -10,6 +10,31 @@
 #include <algorithm>
 #include <filesystem>
 #include <stdexcept>
+#include <cmath>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <memory>
+#include <cstring>
+#include <array>
+#include <random>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace fs = std::filesystem;
 
@@ -19,8 +44,8 @@ static std::pair<std::string, uint32_t> bwtTransform(const std::string& s) {
     std::iota(idx.begin(), idx.end(), 0);
     std::sort(idx.begin(), idx.end(), [&](int a, int b) {
         for (int k = 0; k < n; ++k) {
-            char ca = s[(a + k) % n];
-            char cb = s[(b + k) % n];
+            unsigned char ca = s[(a + k) % n];
+            unsigned char cb = s[(b + k) % n];
             if (ca != cb) return ca < cb;
         }
         return false;
@@ -118,17 +143,76 @@ static std::string bwtInverse(const std::string& last, uint32_t primary) {
     return out;
 }
 
+class SnapshotWriter {
+    std::ostream& os;
+public:
+    explicit SnapshotWriter(std::ostream& o) : os(o) {}
+
+    template <typename T>
+    void put(const T& v) { os.write(reinterpret_cast<const char*>(&v), sizeof(v)); }
+    void putBytes(const void* p, size_t n) { os.write(static_cast<const char*>(p), n); }
+};
+
+class SnapshotReader {
+    const char* p;
+    const char* end;
+public:
+    SnapshotReader(const char* data, size_t size) : p(data), end(data + size) {}
+
+    template <typename T>
+    T get() {
+        T v;
+        getBytes(&v, sizeof(v));
+        return v;
+    }
+
+    void getBytes(void* out, size_t n) {
+        if (size_t(end - p) < n)
+            throw std::runtime_error("Corrupt snapshot");
+        std::memcpy(out, p, n);
+        p += n;
+    }
+
+    void check(bool ok) const {
+        if (!ok) throw std::runtime_error("Corrupt snapshot");
+    }
+};
+
+using CountTable = std::unordered_map<uint32_t, std::pair<uint32_t, uint32_t>>;
+
+static void saveCounts(SnapshotWriter& w, const CountTable& table) {
+    w.put(uint64_t(table.size()));
+    for (const auto& [key, c] : table) {
+        w.put(key);
+        w.put(c.first);
+        w.put(c.second);
+    }
+}
+
+static void loadCounts(SnapshotReader& r, CountTable& table) {
+    uint64_t n = r.get<uint64_t>();
+    table.clear();
+    table.reserve(size_t(n));
+    for (uint64_t i = 0; i < n; ++i) {
+        uint32_t key = r.get<uint32_t>();
+        uint32_t c0 = r.get<uint32_t>();
+        table[key] = { c0, r.get<uint32_t>() };
+    }
+}
+
 class IModel {
 public:
     virtual ~IModel() = default;
     virtual uint16_t predict() const = 0;
     virtual void updateBit(int bit) = 0;
     virtual void updateByte(uint8_t b) = 0;
+    virtual void save(SnapshotWriter& w) const = 0;
+    virtual void load(SnapshotReader& r) = 0;
 };
 
 class ByteContextModel : public IModel {
     size_t order;
-    std::unordered_map<uint32_t, std::pair<uint32_t, uint32_t>> table;
+    CountTable table;
     std::deque<uint8_t> history;
 public:
     explicit ByteContextModel(size_t ord)
@@ -161,11 +245,27 @@ public:
         if (history.size() == order) history.pop_front();
         history.push_back(b);
     }
+
+    void save(SnapshotWriter& w) const override {
+        w.put(uint32_t(order));
+        w.put(uint32_t(history.size()));
+        for (uint8_t b : history) w.put(b);
+        saveCounts(w, table);
+    }
+
+    void load(SnapshotReader& r) override {
+        r.check(r.get<uint32_t>() == order);
+        uint32_t n = r.get<uint32_t>();
+        r.check(n <= order);
+        history.clear();
+        for (uint32_t i = 0; i < n; ++i) history.push_back(r.get<uint8_t>());
+        loadCounts(r, table);
+    }
 };
 
 class BitContextModel : public IModel {
     size_t order;
-    std::unordered_map<uint32_t, std::pair<uint32_t, uint32_t>> table;
+    CountTable table;
     std::deque<bool> history;
 public:
     explicit BitContextModel(size_t ord)
@@ -201,6 +301,22 @@ public:
 
     void updateByte(uint8_t) override {
     }
+
+    void save(SnapshotWriter& w) const override {
+        w.put(uint32_t(order));
+        w.put(uint32_t(history.size()));
+        for (bool b : history) w.put(uint8_t(b));
+        saveCounts(w, table);
+    }
+
+    void load(SnapshotReader& r) override {
+        r.check(r.get<uint32_t>() == order);
+        uint32_t n = r.get<uint32_t>();
+        r.check(n <= order);
+        history.clear();
+        for (uint32_t i = 0; i < n; ++i) history.push_back(r.get<uint8_t>() != 0);
+        loadCounts(r, table);
+    }
 };
 
 class MatchModel : public IModel {
@@ -209,6 +325,7 @@ class MatchModel : public IModel {
 
     std::vector<uint8_t> buffer;
     size_t bufPos = 0;
+    bool wrapped = false;
 
     std::unordered_map<uint64_t, size_t> lastPos;
     size_t matchPos = std::string::npos;
@@ -281,6 +398,45 @@ public:
         }
 
         bufPos = (bufPos + 1) % WINDOW_SIZE;
+        if (bufPos == 0) wrapped = true;
+    }
+
+    void save(SnapshotWriter& w) const override {
+        uint64_t used = wrapped ? WINDOW_SIZE : bufPos;
+        w.put(uint32_t(contextSize));
+        w.put(uint64_t(bufPos));
+        w.put(uint64_t(matchPos));
+        w.put(int32_t(matchLen));
+        w.put(int32_t(bitPos));
+        w.put(used);
+        w.putBytes(buffer.data(), size_t(used));
+        w.put(uint64_t(lastPos.size()));
+        for (const auto& [key, pos] : lastPos) {
+            w.put(key);
+            w.put(uint64_t(pos));
+        }
+    }
+
+    void load(SnapshotReader& r) override {
+        r.check(r.get<uint32_t>() == contextSize);
+        bufPos = size_t(r.get<uint64_t>());
+        matchPos = size_t(r.get<uint64_t>());
+        matchLen = r.get<int32_t>();
+        bitPos = r.get<int32_t>();
+        uint64_t used = r.get<uint64_t>();
+        r.check(bufPos < WINDOW_SIZE && used <= WINDOW_SIZE && bitPos >= 0 && bitPos < 8
+            && (matchPos == std::string::npos || matchPos < WINDOW_SIZE));
+        wrapped = used == WINDOW_SIZE;
+        r.getBytes(buffer.data(), size_t(used));
+        uint64_t n = r.get<uint64_t>();
+        lastPos.clear();
+        lastPos.reserve(size_t(n));
+        for (uint64_t i = 0; i < n; ++i) {
+            uint64_t key = r.get<uint64_t>();
+            uint64_t pos = r.get<uint64_t>();
+            r.check(pos < WINDOW_SIZE);
+            lastPos[key] = size_t(pos);
+        }
     }
 };
 
@@ -290,6 +446,7 @@ class LZPModel : public IModel {
     std::vector<size_t>  nxt;
     size_t pos = 0;
     uint8_t prev = 0;
+    bool wrapped = false;
 
 public:
     LZPModel()
@@ -315,24 +472,77 @@ public:
         nxt[key % N] = pos;
         prev = b;
         pos = (pos + 1) % N;
+        if (pos == 0) wrapped = true;
+    }
+
+    // nxt is mostly unset after a small corpus, so only set slots are stored.
+    void save(SnapshotWriter& w) const override {
+        uint64_t used = wrapped ? N : pos;
+        w.put(uint64_t(pos));
+        w.put(prev);
+        w.put(used);
+        w.putBytes(buf.data(), size_t(used));
+        w.put(uint64_t(std::count_if(nxt.begin(), nxt.end(), [](size_t v) { return v != std::string::npos; })));
+        for (size_t i = 0; i < N; ++i) {
+            if (nxt[i] == std::string::npos) continue;
+            w.put(uint32_t(i));
+            w.put(uint32_t(nxt[i]));
+        }
+    }
+
+    void load(SnapshotReader& r) override {
+        pos = size_t(r.get<uint64_t>());
+        prev = r.get<uint8_t>();
+        uint64_t used = r.get<uint64_t>();
+        r.check(pos < N && used <= N);
+        wrapped = used == N;
+        r.getBytes(buf.data(), size_t(used));
+        uint64_t n = r.get<uint64_t>();
+        r.check(n <= N);
+        std::fill(nxt.begin(), nxt.end(), std::string::npos);
+        for (uint64_t i = 0; i < n; ++i) {
+            uint32_t idx = r.get<uint32_t>();
+            uint32_t val = r.get<uint32_t>();
+            r.check(idx < N && val < N);
+            nxt[idx] = val;
+        }
     }
 };
 
 class Mixer {
+    // Gating: every SEGMENT_BYTES bytes, models whose share of the mixed
+    // stretch fell below MIN_SHARE are switched off; every PROBE_INTERVAL
+    // segments all of them get one segment to prove themselves again.
+    // Decisions only use already coded bits, so the decoder follows along.
+    static constexpr uint32_t SEGMENT_BYTES = 4096;
+    static constexpr uint32_t PROBE_INTERVAL = 16;
+    static constexpr double MIN_SHARE = 0.02;
+
     std::vector<IModel*> mods;
     std::vector<double> w;
+    std::vector<double> st;
+    std::vector<double> contrib;
+    std::vector<bool> active;
     double lr;
+    bool gating;
+    uint32_t segmentBytes = 0;
+    uint32_t segment = 0;
 public:
-    Mixer(const std::vector<IModel*>& M, double learningRate = 0.005)
-        : mods(M), w(M.size(), 1.0), lr(learningRate) {
+    Mixer(const std::vector<IModel*>& M, double learningRate = 0.005, bool gate = false)
+        : mods(M), w(M.size(), 1.0), st(M.size(), 0.0), contrib(M.size(), 0.0),
+        active(M.size(), true), lr(learningRate), gating(gate) {
         if (w.empty()) w.back() = 2.0;
     }
 
-    uint16_t mix() const {
+    bool isActive(size_t i) const { return active[i]; }
+
+    uint16_t mix() {
         double sum = 0.0;
         for (size_t i = 0; i < mods.size(); ++i) {
+            if (!active[i]) continue;
             double pi = std::clamp(mods[i]->predict() / 65535.0, 0.0001, 0.9999);
-            sum += w[i] * std::log(pi / (1.0 - pi));
+            st[i] = std::log(pi / (1.0 - pi));
+            sum += w[i] * st[i];
         }
         double p = 1.0 / (1.0 + std::exp(-sum));
         return static_cast<uint16_t>(p * 65535.0 + 0.5);
@@ -342,11 +552,33 @@ public:
         double p = std::clamp(p1 / 65535.0, 0.0001, 0.9999);
         double error = bit - p;
         for (size_t i = 0; i < mods.size(); ++i) {
-            double pi = std::clamp(mods[i]->predict() / 65535.0, 0.0001, 0.9999);
-            double grad = std::log(pi / (1.0 - pi));
-            w[i] += lr * error * grad;
+            if (!active[i]) continue;
+            contrib[i] += std::abs(w[i] * st[i]);
+            w[i] += lr * error * st[i];
         }
     }
+
+    void endByte() {
+        if (!gating || ++segmentBytes < SEGMENT_BYTES) return;
+        segmentBytes = 0;
+        bool probe = ++segment % PROBE_INTERVAL == 0;
+        double total = std::accumulate(contrib.begin(), contrib.end(), 0.0);
+        // The first model is never gated so the mixer always has an input.
+        for (size_t i = 1; i < mods.size(); ++i)
+            active[i] = probe || (active[i] && contrib[i] >= total * MIN_SHARE);
+        std::fill(contrib.begin(), contrib.end(), 0.0);
+    }
+
+    // Only the weights are primed; gating always starts with every model on.
+    void save(SnapshotWriter& sw) const {
+        sw.put(uint32_t(w.size()));
+        sw.putBytes(w.data(), w.size() * sizeof(double));
+    }
+
+    void load(SnapshotReader& sr) {
+        sr.check(sr.get<uint32_t>() == w.size());
+        sr.getBytes(w.data(), w.size() * sizeof(double));
+    }
 };
 
 class RangeCoder {
@@ -409,110 +641,1079 @@ public:
     }
 };
 
-static bool exists(const std::string& p) { return fs::exists(p); }
+// Read-only view of a whole file, shared by every worker that needs it.
+class MappedFile {
+    const char* ptr = nullptr;
+    size_t len = 0;
+#ifdef _WIN32
+    HANDLE mapping = nullptr;
+#endif
+public:
+    explicit MappedFile(const std::string& path) {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Cannot open snapshot");
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+            CloseHandle(file);
+            throw std::runtime_error("Corrupt snapshot");
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(file);
+        if (!mapping)
+            throw std::runtime_error("Cannot map snapshot");
+        ptr = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!ptr) {
+            CloseHandle(mapping);
+            throw std::runtime_error("Cannot map snapshot");
+        }
+        len = size_t(size.QuadPart);
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Cannot open snapshot");
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            throw std::runtime_error("Corrupt snapshot");
+        }
+        void* p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            throw std::runtime_error("Cannot map snapshot");
+        ptr = static_cast<const char*>(p);
+        len = size_t(st.st_size);
+#endif
+    }
 
-void Compressor::compress(const std::string& inPath, const std::string& outPath) {
-    namespace fs = std::filesystem;
-    if (fs::exists(outPath))
-        throw std::runtime_error("Output already exists");
+    ~MappedFile() {
+#ifdef _WIN32
+        UnmapViewOfFile(ptr);
+        CloseHandle(mapping);
+#else
+        munmap(const_cast<char*>(ptr), len);
+#endif
+    }
 
-    std::ifstream fin(inPath, std::ios::binary);
-    if (!fin) 
-        throw std::runtime_error("Cannot open input");
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
 
-    std::string input((std::istreambuf_iterator<char>(fin)), {});
-    fin.close();
-    std::ofstream out(outPath, std::ios::binary);
-    if (!out) 
-        throw std::runtime_error("Cannot open output");
+    const char* data() const { return ptr; }
+    size_t size() const { return len; }
+};
 
-    uint64_t fullSize = input.size();
-    out.write(reinterpret_cast<const char*>(&fullSize), sizeof(fullSize));
+// Model state trained on a sample corpus: magic, version, a 64-bit ID (hash of
+// the state, recorded in archives that use it) and every model's tables.
+static constexpr char SNAPSHOT_MAGIC[4] = { 'Z', 'B', 'S', 'N' };
+static constexpr uint8_t SNAPSHOT_VERSION = 1;
+
+struct Snapshot {
+    MappedFile file;
+    uint64_t id = 0;
+
+    explicit Snapshot(const std::string& path)
+        : file(path) {
+        SnapshotReader r(file.data(), file.size());
+        char magic[sizeof(SNAPSHOT_MAGIC)];
+        r.getBytes(magic, sizeof(magic));
+        r.check(std::equal(magic, magic + sizeof(magic), SNAPSHOT_MAGIC));
+        r.check(r.get<uint8_t>() == SNAPSHOT_VERSION);
+        id = r.get<uint64_t>();
+    }
+
+    SnapshotReader state() const {
+        size_t header = sizeof(SNAPSHOT_MAGIC) + sizeof(SNAPSHOT_VERSION) + sizeof(id);
+        return SnapshotReader(file.data() + header, file.size() - header);
+    }
+};
 
-    ByteContextModel bcm1(1), bcm2(2), bcm3(3), bcm4(4);
-    BitContextModel bitm(24);
-    MatchModel match4(4), match8(8);
+struct ModelSet {
+    ByteContextModel bcm1{ 1 }, bcm2{ 2 }, bcm3{ 3 }, bcm4{ 4 };
+    BitContextModel bitm{ 24 };
+    MatchModel match4{ 4 }, match8{ 8 };
     LZPModel lzp;
-    std::vector<IModel*> mods = { &bcm1, &bcm2, &bcm3, &bcm4, &bitm, &match4, &match8, &lzp };
-    Mixer mixer(mods, 0.001);
+    std::vector<IModel*> mods{ &bcm1, &bcm2, &bcm3, &bcm4, &bitm, &match4, &match8, &lzp };
+    Mixer mixer;
 
-    auto [bwtLast, primary] = bwtTransform(input);
-    auto mtf = mtfEncode(bwtLast);
-    auto rle = rleZero(mtf);
+    explicit ModelSet(bool gating)
+        : mixer(mods, 0.001, gating) {
+    }
+    ModelSet(const ModelSet&) = delete;
+    ModelSet& operator=(const ModelSet&) = delete;
+
+    void updateBit(uint16_t p1, int bit) {
+        mixer.update(p1, bit);
+        for (size_t i = 0; i < mods.size(); ++i)
+            if (mixer.isActive(i)) mods[i]->updateBit(bit);
+    }
+
+    void updateByte(uint8_t b) {
+        for (IModel* m : mods) m->updateByte(b);
+        mixer.endByte();
+    }
+
+    void save(SnapshotWriter& w) const {
+        for (const IModel* m : mods) m->save(w);
+        mixer.save(w);
+    }
+
+    void load(const Snapshot& snapshot) {
+        SnapshotReader r = snapshot.state();
+        for (IModel* m : mods) m->load(r);
+        mixer.load(r);
+    }
+};
 
+static std::string encodeBlock(const std::vector<uint8_t>& rle, bool gating, const Snapshot* snapshot) {
+    ModelSet ms(gating);
+    if (snapshot) ms.load(*snapshot);
     std::ostringstream tmp(std::ios::binary);
     RangeCoder coder(tmp);
     for (uint8_t byte : rle) {
         for (int b = 7; b >= 0; --b) {
             int bit = (byte >> b) & 1;
-            uint16_t p1 = mixer.mix();
+            uint16_t p1 = ms.mixer.mix();
             coder.encode(bit, p1);
-            mixer.update(p1, bit);
-            for (IModel* m : mods)
-                m->updateBit(bit);
+            ms.updateBit(p1, bit);
         }
-        for (auto* m : mods) m->updateByte(byte);
+        ms.updateByte(byte);
     }
-
     coder.finish();
-    std::string compData = tmp.str();
-    uint32_t blockLen = uint32_t(input.size());
-    uint32_t rleCount = uint32_t(rle.size());
-    uint32_t compSize = uint32_t(compData.size());
+    return tmp.str();
+}
+
+static std::vector<uint8_t> decodeBlock(const std::string& payload, uint32_t rleCount, bool gating, const Snapshot* snapshot) {
+    ModelSet ms(gating);
+    if (snapshot) ms.load(*snapshot);
+    std::istringstream tmpIn(payload, std::ios::binary);
+    RangeDecoder dec(tmpIn);
+    std::vector<uint8_t> rle;
+    rle.reserve(rleCount);
+    for (uint32_t i = 0; i < rleCount; ++i) {
+        uint8_t c = 0;
+        for (int b = 7; b >= 0; --b) {
+            uint16_t p1 = ms.mixer.mix();
+            int bit = dec.decode(p1);
+            ms.updateBit(p1, bit);
+            c |= (uint8_t(bit) << b);
+        }
+        rle.push_back(c);
+        ms.updateByte(c);
+    }
+    return rle;
+}
+
+// Static order-0 rANS over the RLE symbols: 32-bit states renormalized a byte
+// at a time, RANS_STATES of them interleaved so consecutive symbols belong to
+// independent dependency chains. The payload starts with a bitmap of present
+// symbols and their frequencies (scaled to RANS_TOTAL, 1 or 2 bytes each).
+static constexpr uint32_t RANS_SCALE_BITS = 12;
+static constexpr uint32_t RANS_TOTAL = 1u << RANS_SCALE_BITS;
+static constexpr uint32_t RANS_LOW = 1u << 23;
+static constexpr size_t RANS_STATES = 4;
+
+static std::vector<uint32_t> ransFrequencies(const std::vector<uint8_t>& syms) {
+    std::vector<uint32_t> count(256, 0), freq(256, 0);
+    for (uint8_t c : syms) ++count[c];
+    uint32_t total = 0;
+    for (int c = 0; c < 256; ++c) {
+        if (!count[c]) continue;
+        freq[c] = std::max<uint32_t>(1, uint32_t(uint64_t(count[c]) * RANS_TOTAL / syms.size()));
+        total += freq[c];
+    }
+    // Rounding leaves the sum off by a little; take it from or give it to the
+    // most frequent symbols, never dropping one below 1.
+    std::vector<int> order(256);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return count[a] > count[b]; });
+    for (size_t k = 0; total != RANS_TOTAL; k = (k + 1) % 256) {
+        int c = order[k];
+        if (!count[c]) { k = size_t(-1); continue; }
+        if (total < RANS_TOTAL) { ++freq[c]; ++total; }
+        else if (freq[c] > 1) { --freq[c]; --total; }
+    }
+    return freq;
+}
+
+static std::string ransEncode(const std::vector<uint8_t>& syms) {
+    std::string out;
+    if (syms.empty()) return out;
+
+    std::vector<uint32_t> freq = ransFrequencies(syms), cum(257, 0);
+    for (int c = 0; c < 256; ++c) cum[c + 1] = cum[c] + freq[c];
+
+    uint8_t present[32] = {};
+    for (int c = 0; c < 256; ++c)
+        if (freq[c]) present[c >> 3] |= uint8_t(1 << (c & 7));
+    out.append(reinterpret_cast<const char*>(present), sizeof(present));
+    for (int c = 0; c < 256; ++c) {
+        if (!freq[c]) continue;
+        if (freq[c] < 0x80) out.push_back(char(freq[c]));
+        else {
+            out.push_back(char(0x80 | (freq[c] >> 8)));
+            out.push_back(char(freq[c] & 0xFF));
+        }
+    }
+
+    // rANS is last-in first-out: encode backwards into the tail of a buffer.
+    std::vector<uint8_t> buf(2 * syms.size() + 4 * RANS_STATES);
+    uint8_t* ptr = buf.data() + buf.size();
+    uint32_t state[RANS_STATES];
+    std::fill(state, state + RANS_STATES, RANS_LOW);
+    for (size_t i = syms.size(); i-- > 0;) {
+        uint32_t& x = state[i % RANS_STATES];
+        uint32_t f = freq[syms[i]];
+        uint32_t xMax = ((RANS_LOW >> RANS_SCALE_BITS) << 8) * f;
+        while (x >= xMax) {
+            *--ptr = uint8_t(x);
+            x >>= 8;
+        }
+        x = ((x / f) << RANS_SCALE_BITS) + (x % f) + cum[syms[i]];
+    }
+    for (size_t j = RANS_STATES; j-- > 0;) {
+        for (int k = 0; k < 4; ++k) {
+            *--ptr = uint8_t(state[j]);
+            state[j] >>= 8;
+        }
+    }
+    out.append(reinterpret_cast<const char*>(ptr), size_t(buf.data() + buf.size() - ptr));
+    return out;
+}
+
+static std::vector<uint8_t> ransDecode(const std::string& payload, uint32_t count) {
+    std::vector<uint8_t> syms(count);
+    if (count == 0) return syms;
+
+    const uint8_t* ptr = reinterpret_cast<const uint8_t*>(payload.data());
+    const uint8_t* end = ptr + payload.size();
+    if (payload.size() < 32 + 4 * RANS_STATES)
+        throw std::runtime_error("Corrupt block");
+    const uint8_t* present = ptr;
+    ptr += 32;
+
+    std::vector<uint32_t> freq(256, 0), cum(256, 0);
+    std::vector<uint8_t> slotSym(RANS_TOTAL);
+    uint32_t total = 0;
+    for (int c = 0; c < 256; ++c) {
+        if (!(present[c >> 3] & (1 << (c & 7)))) continue;
+        if (ptr == end) throw std::runtime_error("Corrupt block");
+        uint32_t f = *ptr++;
+        if (f & 0x80) {
+            if (ptr == end) throw std::runtime_error("Corrupt block");
+            f = ((f & 0x7F) << 8) | *ptr++;
+        }
+        if (f == 0 || total + f > RANS_TOTAL) throw std::runtime_error("Corrupt block");
+        freq[c] = f;
+        cum[c] = total;
+        std::fill(slotSym.begin() + total, slotSym.begin() + total + f, uint8_t(c));
+        total += f;
+    }
+    if (total != RANS_TOTAL || end - ptr < std::ptrdiff_t(4 * RANS_STATES))
+        throw std::runtime_error("Corrupt block");
+
+    uint32_t state[RANS_STATES];
+    for (auto& x : state) {
+        x = uint32_t(ptr[0]) << 24 | uint32_t(ptr[1]) << 16 | uint32_t(ptr[2]) << 8 | ptr[3];
+        ptr += 4;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t& x = state[i % RANS_STATES];
+        uint32_t slot = x & (RANS_TOTAL - 1);
+        uint8_t c = slotSym[slot];
+        syms[i] = c;
+        x = freq[c] * (x >> RANS_SCALE_BITS) + slot - cum[c];
+        while (x < RANS_LOW) {
+            if (ptr == end) throw std::runtime_error("Corrupt block");
+            x = (x << 8) | *ptr++;
+        }
+    }
+    return syms;
+}
+
+// Blocks are coded with fresh models, so any number of them can be in flight at once.
+static constexpr size_t BLOCK_SIZE = 1 << 20;
+
+// Archives open with MAGIC and a format version. Version 1 archives predate
+// the magic and start directly with the original file size.
+static constexpr char MAGIC[4] = { 'Z', 'B', 'I', 'T' };
+static constexpr char BATCH_MAGIC[4] = { 'Z', 'B', 'A', 'R' };
+static constexpr uint8_t FORMAT_LEGACY = 1;
+static constexpr uint8_t FORMAT_GATED = 2;
+static constexpr uint8_t FORMAT_BACKEND = 3;
+static constexpr uint8_t FORMAT_SNAPSHOT = 4;
+static constexpr uint8_t FORMAT_CURRENT = FORMAT_SNAPSHOT;
+
+struct Block {
+    size_t index = 0;
+    uint32_t blockLen = 0;
+    uint32_t primary = 0;
+    uint32_t rleCount = 0;
+    std::string raw;
+    std::vector<uint8_t> rle;
+    std::string payload;
+};
+
+template <typename T>
+class BoundedQueue {
+    std::mutex m;
+    std::condition_variable notFull, notEmpty;
+    std::deque<T> items;
+    const size_t capacity;
+    bool closed = false;
+public:
+    explicit BoundedQueue(size_t cap)
+        : capacity(cap) {
+    }
+
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(m);
+        notFull.wait(lock, [&] { return closed || items.size() < capacity; });
+        if (closed) return false;
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(m);
+        notEmpty.wait(lock, [&] { return closed || !items.empty(); });
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    // Producers are done; consumers drain what is left.
+    void close() {
+        std::lock_guard<std::mutex> lock(m);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+    // Something failed; wake everyone and drop what is left.
+    void abort() {
+        std::lock_guard<std::mutex> lock(m);
+        closed = true;
+        items.clear();
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+};
+
+class Pipeline {
+    std::vector<std::thread> threads;
+    std::vector<std::function<void()>> aborts;
+    std::mutex errMutex;
+    std::exception_ptr error;
+
+    void fail(std::exception_ptr e) {
+        std::lock_guard<std::mutex> lock(errMutex);
+        if (!error) error = e;
+        for (auto& a : aborts) a();
+    }
+
+    void join() {
+        for (auto& t : threads)
+            if (t.joinable()) t.join();
+    }
+public:
+    ~Pipeline() {
+        for (auto& a : aborts) a();
+        join();
+    }
+
+    template <typename T>
+    void watch(BoundedQueue<T>& q) {
+        aborts.push_back([&q] { q.abort(); });
+    }
+
+    void spawn(std::function<void()> fn) {
+        threads.emplace_back([this, fn] {
+            try { fn(); }
+            catch (...) { fail(std::current_exception()); }
+            });
+    }
 
-    out.write(reinterpret_cast<const char*>(&blockLen), sizeof(blockLen));
-    out.write(reinterpret_cast<const char*>(&primary), sizeof(primary));
-    out.write(reinterpret_cast<const char*>(&rleCount), sizeof(rleCount));
-    out.write(reinterpret_cast<const char*>(&compSize), sizeof(compSize));
-    out.write(compData.data(), compData.size());
+    template <typename Fn>
+    void stage(size_t workers, BoundedQueue<Block>& in, BoundedQueue<Block>& out, Fn fn) {
+        auto remaining = std::make_shared<std::atomic<size_t>>(workers);
+        for (size_t i = 0; i < workers; ++i) {
+            spawn([&in, &out, fn, remaining] {
+                Block b;
+                while (in.pop(b)) {
+                    fn(b);
+                    if (!out.push(std::move(b))) break;
+                }
+                if (--*remaining == 0) out.close();
+                });
+        }
+    }
+
+    void wait() {
+        join();
+        if (error) std::rethrow_exception(error);
+    }
+};
+
+static size_t hardwareWorkers() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Each context-mixing coder owns a full ModelSet whose hash tables can grow
+// to a few hundred MB on incompressible blocks, so only a few run at once.
+static constexpr size_t MAX_CM_WORKERS = 2;
+
+// Reader -> transform workers -> coder workers -> ordered writer. The slot
+// queue caps how many blocks are in flight, so a slow block cannot make the
+// writer buffer the rest of the file while it waits for it.
+template <typename Read, typename StageA, typename StageB, typename Write>
+static void runPipeline(Read read, size_t workersA, StageA stageA, size_t workersB, StageB stageB, Write write) {
+    size_t workers = std::max(workersA, workersB);
+    size_t inFlight = 2 * workers + 2;
+    BoundedQueue<size_t> slots(inFlight);
+    BoundedQueue<Block> readQ(workers), midQ(workers), doneQ(workers);
+    for (size_t i = 0; i < inFlight; ++i) slots.push(i);
+
+    Pipeline pipeline;
+    pipeline.watch(slots);
+    pipeline.watch(readQ);
+    pipeline.watch(midQ);
+    pipeline.watch(doneQ);
+
+    pipeline.spawn([&] {
+        size_t slot;
+        for (size_t index = 0; slots.pop(slot); ++index) {
+            Block b;
+            b.index = index;
+            if (!read(b) || !readQ.push(std::move(b))) break;
+        }
+        readQ.close();
+        });
+    pipeline.stage(workersA, readQ, midQ, stageA);
+    pipeline.stage(workersB, midQ, doneQ, stageB);
+    pipeline.spawn([&] {
+        std::map<size_t, Block> pending;
+        size_t next = 0;
+        Block b;
+        while (doneQ.pop(b)) {
+            pending.emplace(b.index, std::move(b));
+            for (auto it = pending.begin(); it != pending.end() && it->first == next; it = pending.erase(it), ++next) {
+                write(it->second);
+                slots.push(next);
+            }
+        }
+        });
+    pipeline.wait();
+}
+
+using Backend = Compressor::Backend;
+
+static size_t coderWorkers(Backend backend) {
+    return backend == Backend::Rans ? hardwareWorkers() : std::min(hardwareWorkers(), MAX_CM_WORKERS);
+}
+
+static void compressBlocks(const std::function<bool(Block&)>& read, Backend backend, const Snapshot* snapshot, std::ostream& out) {
+    runPipeline(
+        read,
+        hardwareWorkers(),
+        [](Block& b) {
+            auto [bwtLast, primary] = bwtTransform(b.raw);
+            b.blockLen = uint32_t(b.raw.size());
+            b.primary = primary;
+            b.rle = rleZero(mtfEncode(bwtLast));
+            std::string().swap(b.raw);
+        },
+        coderWorkers(backend),
+        [backend, snapshot](Block& b) {
+            b.payload = backend == Backend::Rans ? ransEncode(b.rle) : encodeBlock(b.rle, true, snapshot);
+            b.rleCount = uint32_t(b.rle.size());
+            std::vector<uint8_t>().swap(b.rle);
+        },
+        [&](const Block& b) {
+            uint32_t compSize = uint32_t(b.payload.size());
+            out.write(reinterpret_cast<const char*>(&b.blockLen), sizeof(b.blockLen));
+            out.write(reinterpret_cast<const char*>(&b.primary), sizeof(b.primary));
+            out.write(reinterpret_cast<const char*>(&b.rleCount), sizeof(b.rleCount));
+            out.write(reinterpret_cast<const char*>(&compSize), sizeof(compSize));
+            out.write(b.payload.data(), b.payload.size());
+            if (!out)
+                throw std::runtime_error("Cannot write output");
+        });
+}
+
+// Decodes block records until EOF, or until `end` when something follows them,
+// and returns the number of bytes written.
+static uint64_t decompressBlocks(std::istream& in, uint8_t version, Backend backend, const Snapshot* snapshot,
+    std::ostream& out, std::streamoff end = -1) {
+    bool gating = version >= FORMAT_GATED;
+    uint64_t written = 0;
+    runPipeline(
+        [&](Block& b) {
+            uint32_t compSize;
+            if (end >= 0 && in.tellg() >= end)
+                return false;
+            if (!in.read(reinterpret_cast<char*>(&b.blockLen), sizeof(b.blockLen))) {
+                if (in.gcount() == 0) return false;
+                throw std::runtime_error("Truncated input");
+            }
+            in.read(reinterpret_cast<char*>(&b.primary), sizeof(b.primary));
+            in.read(reinterpret_cast<char*>(&b.rleCount), sizeof(b.rleCount));
+            in.read(reinterpret_cast<char*>(&compSize), sizeof(compSize));
+            if (!in)
+                throw std::runtime_error("Truncated input");
+            b.payload.resize(compSize);
+            if (!in.read(&b.payload[0], compSize))
+                throw std::runtime_error("Truncated input");
+            return true;
+        },
+        coderWorkers(backend),
+        [gating, backend, snapshot](Block& b) {
+            b.rle = backend == Backend::Rans
+                ? ransDecode(b.payload, b.rleCount)
+                : decodeBlock(b.payload, b.rleCount, gating, snapshot);
+            std::string().swap(b.payload);
+        },
+        hardwareWorkers(),
+        [](Block& b) {
+            if (b.blockLen == 0) return;
+            auto bwt = mtfDecode(rleZeroDecode(b.rle));
+            if (b.primary >= bwt.size())
+                throw std::runtime_error("Corrupt block");
+            b.raw = bwtInverse(bwt, b.primary);
+            std::vector<uint8_t>().swap(b.rle);
+        },
+        [&](const Block& b) {
+            if (b.raw.size() != b.blockLen)
+                throw std::runtime_error("Corrupt block");
+            out.write(b.raw.data(), b.blockLen);
+            if (!out)
+                throw std::runtime_error("Cannot write output");
+            written += b.blockLen;
+        });
+    return written;
+}
+
+static uint8_t readVersion(std::istream& in, const char (&magic)[sizeof(MAGIC)]) {
+    char found[sizeof(MAGIC)] = {};
+    uint8_t version = FORMAT_LEGACY;
+    if (in.read(found, sizeof(found)) && std::equal(found, found + sizeof(found), magic)) {
+        in.read(reinterpret_cast<char*>(&version), sizeof(version));
+    }
+    else {
+        in.clear();
+        in.seekg(0);
+    }
+    if (version > FORMAT_CURRENT)
+        throw std::runtime_error("Unsupported format version");
+    return version;
+}
+
+static void writeHeader(std::ostream& out, const char (&magic)[sizeof(MAGIC)], Backend backend, const Snapshot* snapshot) {
+    uint8_t version = FORMAT_CURRENT;
+    uint64_t snapshotId = snapshot ? snapshot->id : 0;
+    out.write(magic, sizeof(MAGIC));
+    out.write(reinterpret_cast<const char*>(&version), sizeof(version));
+    out.write(reinterpret_cast<const char*>(&backend), sizeof(backend));
+    out.write(reinterpret_cast<const char*>(&snapshotId), sizeof(snapshotId));
+}
+
+static Backend readBackend(std::istream& in, uint8_t version) {
+    uint8_t backend = 0;
+    if (version >= FORMAT_BACKEND)
+        if (!in.read(reinterpret_cast<char*>(&backend), sizeof(backend)))
+            throw std::runtime_error("Truncated input");
+    if (backend > uint8_t(Backend::Rans))
+        throw std::runtime_error("Unsupported entropy backend");
+    return Backend(backend);
+}
+
+// Snapshots only prime the context-mixing models; rANS has nothing to prime.
+static std::unique_ptr<Snapshot> openSnapshot(const std::string& path, Backend backend) {
+    if (path.empty()) return nullptr;
+    if (backend != Backend::ContextMixing)
+        throw std::runtime_error("Model snapshots require the context-mixing backend");
+    return std::make_unique<Snapshot>(path);
+}
+
+static std::unique_ptr<Snapshot> readSnapshot(std::istream& in, uint8_t version, const std::string& path) {
+    uint64_t id = 0;
+    if (version >= FORMAT_SNAPSHOT && !in.read(reinterpret_cast<char*>(&id), sizeof(id)))
+        throw std::runtime_error("Truncated input");
+    if (id == 0) return nullptr;
+    std::unique_ptr<Snapshot> snapshot;
+    if (!path.empty()) snapshot = std::make_unique<Snapshot>(path);
+    if (!snapshot || snapshot->id != id) {
+        std::ostringstream msg;
+        msg << "Archive needs model snapshot " << std::hex << id;
+        throw std::runtime_error(msg.str());
+    }
+    return snapshot;
+}
+
+// Content-defined chunking (FastCDC): a Gear rolling hash cuts chunks where
+// its top bits are zero, with a stricter mask before CHUNK_AVG and a looser
+// one after it, so cut points survive insertions and deletions around them.
+static constexpr size_t CHUNK_MIN = 2 << 10;
+static constexpr size_t CHUNK_AVG = 8 << 10;
+static constexpr size_t CHUNK_MAX = 64 << 10;
+static constexpr uint64_t CHUNK_MASK_S = ~0ULL << (64 - 15);
+static constexpr uint64_t CHUNK_MASK_L = ~0ULL << (64 - 11);
+
+static const std::vector<uint64_t>& gearTable() {
+    static const std::vector<uint64_t> table = [] {
+        std::vector<uint64_t> g(256);
+        uint64_t x = 0;
+        for (auto& v : g) {
+            uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            v = z ^ (z >> 31);
+        }
+        return g;
+        }();
+    return table;
+}
+
+static size_t findCut(const uint8_t* p, size_t n) {
+    if (n <= CHUNK_MIN) return n;
+    const auto& gear = gearTable();
+    size_t normal = std::min(n, CHUNK_AVG);
+    size_t limit = std::min(n, CHUNK_MAX);
+    uint64_t h = 0;
+    size_t i = CHUNK_MIN;
+    for (; i < normal; ++i) {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & CHUNK_MASK_S)) return i + 1;
+    }
+    for (; i < limit; ++i) {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & CHUNK_MASK_L)) return i + 1;
+    }
+    return limit;
+}
+
+// SHA-256: chunks with equal digests are treated as identical without
+// comparing bytes, so the digest has to be collision resistant.
+using ChunkHash = std::array<uint8_t, 32>;
+
+struct ChunkHashHasher {
+    size_t operator()(const ChunkHash& h) const {
+        size_t v;
+        std::memcpy(&v, h.data(), sizeof(v));
+        return v;
+    }
+};
+
+static ChunkHash hashChunk(const std::string& chunk) {
+    static constexpr uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+    auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+    uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+    std::string msg = chunk;
+    uint64_t bits = uint64_t(chunk.size()) * 8;
+    msg.push_back(char(0x80));
+    while (msg.size() % 64 != 56) msg.push_back(0);
+    for (int k = 7; k >= 0; --k) msg.push_back(char(bits >> (8 * k)));
+
+    for (size_t off = 0; off < msg.size(); off += 64) {
+        uint32_t w[64];
+        for (int t = 0; t < 16; ++t) {
+            const uint8_t* q = reinterpret_cast<const uint8_t*>(msg.data()) + off + 4 * t;
+            w[t] = uint32_t(q[0]) << 24 | uint32_t(q[1]) << 16 | uint32_t(q[2]) << 8 | q[3];
+        }
+        for (int t = 16; t < 64; ++t) {
+            uint32_t s0 = rotr(w[t - 15], 7) ^ rotr(w[t - 15], 18) ^ (w[t - 15] >> 3);
+            uint32_t s1 = rotr(w[t - 2], 17) ^ rotr(w[t - 2], 19) ^ (w[t - 2] >> 10);
+            w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int t = 0; t < 64; ++t) {
+            uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[t] + w[t];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+
+    ChunkHash digest;
+    for (int k = 0; k < 32; ++k)
+        digest[k] = uint8_t(h[k / 4] >> (24 - 8 * (k % 4)));
+    return digest;
+}
+
+class ChunkReader {
+    static constexpr size_t READ_SIZE = 1 << 20;
+    std::ifstream in;
+    std::string buf;
+    size_t pos = 0;
+    bool eof = false;
+public:
+    explicit ChunkReader(const std::string& path)
+        : in(path, std::ios::binary) {
+        if (!in)
+            throw std::runtime_error("Cannot open input");
+    }
+
+    bool next(std::string& chunk) {
+        if (!eof && buf.size() - pos < CHUNK_MAX) {
+            buf.erase(0, pos);
+            pos = 0;
+            size_t have = buf.size();
+            buf.resize(have + READ_SIZE);
+            in.read(&buf[have], READ_SIZE);
+            if (in.bad())
+                throw std::runtime_error("Cannot read input");
+            eof = size_t(in.gcount()) < READ_SIZE;
+            buf.resize(have + size_t(in.gcount()));
+        }
+        if (pos == buf.size()) return false;
+        size_t n = findCut(reinterpret_cast<const uint8_t*>(buf.data()) + pos, buf.size() - pos);
+        chunk.assign(buf, pos, n);
+        pos += n;
+        return true;
+    }
+};
+
+// Batch entries are unpacked as outDir / name, so only names that are a single
+// path component on every platform are allowed. A backslash counts as a
+// separator, so a Linux name like a\b is refused when packing, not unpacking.
+static bool isPlainFileName(const std::string& name) {
+    fs::path p(name);
+    return !name.empty() && name != "." && name != ".." && !p.is_absolute() && !p.has_root_name()
+        && p.filename() == p && name.find_first_of("/\\") == std::string::npos;
+}
+
+struct BatchEntry {
+    std::string name;
+    uint64_t size = 0;
+    std::vector<uint32_t> refs;
+};
+
+// Feeds the block pipeline with the first occurrence of every chunk across
+// all inputs and records, per file, which chunks rebuild it.
+class DedupSource {
+    const std::vector<std::string>& paths;
+    size_t fileIdx = 0;
+    std::unique_ptr<ChunkReader> reader;
+    std::unordered_map<ChunkHash, uint32_t, ChunkHashHasher> seen;
+    std::string pending;
+
+    bool pull() {
+        std::string chunk;
+        for (;;) {
+            if (!reader) {
+                if (fileIdx == paths.size()) return false;
+                reader = std::make_unique<ChunkReader>(paths[fileIdx]);
+                files.push_back({ fs::path(paths[fileIdx]).filename().string(), 0, {} });
+            }
+            if (reader->next(chunk)) break;
+            reader.reset();
+            ++fileIdx;
+        }
+        auto [it, isNew] = seen.emplace(hashChunk(chunk), uint32_t(chunkLens.size()));
+        if (isNew) {
+            chunkLens.push_back(uint32_t(chunk.size()));
+            pending += chunk;
+        }
+        files.back().size += chunk.size();
+        files.back().refs.push_back(it->second);
+        return true;
+    }
+public:
+    std::vector<uint32_t> chunkLens;
+    std::vector<BatchEntry> files;
+
+    explicit DedupSource(const std::vector<std::string>& p)
+        : paths(p) {
+    }
+
+    bool read(Block& b) {
+        while (pending.size() < BLOCK_SIZE && pull()) {}
+        size_t n = std::min(pending.size(), BLOCK_SIZE);
+        b.raw.assign(pending, 0, n);
+        pending.erase(0, n);
+        return n > 0;
+    }
+};
+
+// Scratch file in the system temp directory under a fresh name, never one
+// that already exists, removed again when it goes out of scope.
+struct TempFile {
+    fs::path path;
+
+    TempFile() {
+        std::random_device rd;
+        std::mt19937_64 rng((uint64_t(rd()) << 32) ^ rd());
+        do {
+            std::ostringstream name;
+            name << "zerobit-" << std::hex << rng() << ".tmp";
+            path = fs::temp_directory_path() / name.str();
+        } while (fs::exists(path));
+    }
+    TempFile(const TempFile&) = delete;
+    TempFile& operator=(const TempFile&) = delete;
+
+    ~TempFile() {
+        std::error_code ec;
+        fs::remove(path, ec);
+    }
+};
+
+void Compressor::compress(const std::string& inPath, const std::string& outPath, Backend backend,
+    const std::string& snapshotPath) {
+    namespace fs = std::filesystem;
+    if (fs::exists(outPath))
+        throw std::runtime_error("Output already exists");
+
+    std::ifstream fin(inPath, std::ios::binary);
+    if (!fin) 
+        throw std::runtime_error("Cannot open input");
+
+    auto snapshot = openSnapshot(snapshotPath, backend);
+    std::ofstream out(outPath, std::ios::binary);
+    if (!out) 
+        throw std::runtime_error("Cannot open output");
+
+    uint64_t fullSize = fs::file_size(inPath);
+    writeHeader(out, MAGIC, backend, snapshot.get());
+    out.write(reinterpret_cast<const char*>(&fullSize), sizeof(fullSize));
+
+    compressBlocks([&](Block& b) {
+        b.raw.resize(BLOCK_SIZE);
+        fin.read(&b.raw[0], BLOCK_SIZE);
+        if (fin.bad())
+            throw std::runtime_error("Cannot read input");
+        b.raw.resize(size_t(fin.gcount()));
+        return !b.raw.empty();
+        }, backend, snapshot.get(), out);
 }
 
-void Compressor::decompress(const std::string& inPath, const std::string& outPath) {
+void Compressor::decompress(const std::string& inPath, const std::string& outPath, const std::string& snapshotPath) {
     namespace fs = std::filesystem;
     if (!fs::exists(inPath))
         throw std::runtime_error("Input missing");
     std::ifstream in(inPath, std::ios::binary);
     if (!in) throw std::runtime_error("Cannot open input");
+    uint8_t version = readVersion(in, MAGIC);
+    Backend backend = readBackend(in, version);
+    auto snapshot = readSnapshot(in, version, snapshotPath);
     uint64_t fullSize;
-    in.read(reinterpret_cast<char*>(&fullSize), sizeof(fullSize));
-    ByteContextModel bcm1(1), bcm2(2), bcm3(3), bcm4(4);
-    BitContextModel bitm(24);
-    MatchModel match4(4), match8(8);
-    LZPModel lzp;
-    std::vector<IModel*> mods = { &bcm1, &bcm2, &bcm3, &bcm4, &bitm, &match4, &match8, &lzp };
-    Mixer mixer(mods, 0.001);
+    if (!in.read(reinterpret_cast<char*>(&fullSize), sizeof(fullSize)))
+        throw std::runtime_error("Truncated input");
     std::ofstream out(outPath, std::ios::binary);
     if (!out) throw std::runtime_error("Cannot open output");
-    while (true) {
-        uint32_t blockLen, primary, rleCount, compSize;
-        if (!in.read(reinterpret_cast<char*>(&blockLen), sizeof(blockLen)))
-            break;
-        in.read(reinterpret_cast<char*>(&primary), sizeof(primary));
-        in.read(reinterpret_cast<char*>(&rleCount), sizeof(rleCount));
-        in.read(reinterpret_cast<char*>(&compSize), sizeof(compSize));
-        std::vector<char> buf(compSize);
-        in.read(buf.data(), compSize);
-        std::istringstream tmpIn(std::string(buf.data(), compSize), std::ios::binary);
-        RangeDecoder dec(tmpIn);
-        std::vector<uint8_t> rle;
-        rle.reserve(rleCount);
-        for (uint32_t i = 0; i < rleCount; ++i) {
-            uint8_t c = 0;
-            for (int b = 7; b >= 0; --b) {
-                uint16_t p1 = mixer.mix();
-                int bit = dec.decode(p1);
-                mixer.update(p1, bit);
-                for (IModel* model : mods)
-                    model->updateBit(bit);
-                c |= (uint8_t(bit) << b);
+
+    // A cut-off archive ends on a block boundary just as often as inside one,
+    // so only the total size tells a complete file from a partial one.
+    try {
+        uint64_t written = decompressBlocks(in, version, backend, snapshot.get(), out);
+        if (written < fullSize)
+            throw std::runtime_error("Truncated input");
+        if (written > fullSize)
+            throw std::runtime_error("Corrupt block");
+    }
+    catch (...) {
+        out.close();
+        fs::remove(outPath);
+        throw;
+    }
+}
+
+void Compressor::compressBatch(const std::vector<std::string>& inPaths, const std::string& outPath, Backend backend,
+    const std::string& snapshotPath) {
+    if (fs::exists(outPath))
+        throw std::runtime_error("Output already exists");
+    std::unordered_map<std::string, size_t> names;
+    for (const auto& p : inPaths) {
+        std::string name = fs::path(p).filename().string();
+        if (!isPlainFileName(name))
+            throw std::runtime_error("Unsupported file name in batch: " + name);
+        if (++names[name] > 1)
+            throw std::runtime_error("Duplicate file name in batch");
+    }
+
+    auto snapshot = openSnapshot(snapshotPath, backend);
+    std::ofstream out(outPath, std::ios::binary);
+    if (!out)
+        throw std::runtime_error("Cannot open output");
+
+    writeHeader(out, BATCH_MAGIC, backend, snapshot.get());
+
+    DedupSource source(inPaths);
+    compressBlocks([&](Block& b) { return source.read(b); }, backend, snapshot.get(), out);
+
+    // Manifest: chunk lengths in store order, then every file as a list of chunk
+    // indices. Its offset is the last field so the decoder can find it first.
+    uint64_t manifestOffset = uint64_t(out.tellp());
+    uint32_t chunkCount = uint32_t(source.chunkLens.size());
+    uint32_t fileCount = uint32_t(source.files.size());
+    out.write(reinterpret_cast<const char*>(&chunkCount), sizeof(chunkCount));
+    out.write(reinterpret_cast<const char*>(source.chunkLens.data()), chunkCount * sizeof(uint32_t));
+    out.write(reinterpret_cast<const char*>(&fileCount), sizeof(fileCount));
+    for (const auto& f : source.files) {
+        uint32_t nameLen = uint32_t(f.name.size());
+        uint32_t refCount = uint32_t(f.refs.size());
+        out.write(reinterpret_cast<const char*>(&nameLen), sizeof(nameLen));
+        out.write(f.name.data(), nameLen);
+        out.write(reinterpret_cast<const char*>(&f.size), sizeof(f.size));
+        out.write(reinterpret_cast<const char*>(&refCount), sizeof(refCount));
+        out.write(reinterpret_cast<const char*>(f.refs.data()), refCount * sizeof(uint32_t));
+    }
+    out.write(reinterpret_cast<const char*>(&manifestOffset), sizeof(manifestOffset));
+    if (!out)
+        throw std::runtime_error("Cannot write output");
+}
+
+void Compressor::decompressBatch(const std::string& inPath, const std::string& outDir, const std::string& snapshotPath) {
+    if (!fs::exists(inPath))
+        throw std::runtime_error("Input missing");
+    std::ifstream in(inPath, std::ios::binary);
+    if (!in) throw std::runtime_error("Cannot open input");
+    char magic[sizeof(BATCH_MAGIC)] = {};
+    uint8_t version = 0;
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char*>(&version), sizeof(version));
+    if (!in || !std::equal(magic, magic + sizeof(magic), BATCH_MAGIC))
+        throw std::runtime_error("Not a batch archive");
+    if (version > FORMAT_CURRENT)
+        throw std::runtime_error("Unsupported format version");
+    Backend backend = readBackend(in, version);
+    auto snapshot = readSnapshot(in, version, snapshotPath);
+    std::streamoff blocksStart = in.tellg();
+
+    uint64_t manifestOffset = 0;
+    in.seekg(-std::streamoff(sizeof(manifestOffset)), std::ios::end);
+    if (!in.read(reinterpret_cast<char*>(&manifestOffset), sizeof(manifestOffset)))
+        throw std::runtime_error("Truncated input");
+    in.seekg(std::streamoff(manifestOffset));
+    uint32_t chunkCount = 0, fileCount = 0;
+    if (!in.read(reinterpret_cast<char*>(&chunkCount), sizeof(chunkCount)))
+        throw std::runtime_error("Truncated input");
+    std::vector<uint32_t> chunkLens(chunkCount);
+    std::vector<uint64_t> chunkOffsets(chunkCount);
+    in.read(reinterpret_cast<char*>(chunkLens.data()), chunkCount * sizeof(uint32_t));
+    for (uint32_t i = 1; i < chunkCount; ++i)
+        chunkOffsets[i] = chunkOffsets[i - 1] + chunkLens[i - 1];
+    in.read(reinterpret_cast<char*>(&fileCount), sizeof(fileCount));
+    std::vector<BatchEntry> files(fileCount);
+    for (auto& f : files) {
+        uint32_t nameLen = 0, refCount = 0;
+        in.read(reinterpret_cast<char*>(&nameLen), sizeof(nameLen));
+        f.name.resize(nameLen);
+        in.read(&f.name[0], nameLen);
+        in.read(reinterpret_cast<char*>(&f.size), sizeof(f.size));
+        in.read(reinterpret_cast<char*>(&refCount), sizeof(refCount));
+        f.refs.resize(refCount);
+        in.read(reinterpret_cast<char*>(f.refs.data()), refCount * sizeof(uint32_t));
+        if (!in)
+            throw std::runtime_error("Truncated input");
+        for (uint32_t r : f.refs)
+            if (r >= chunkCount) throw std::runtime_error("Corrupt manifest");
+    }
+    // Names come from the archive, so anything that is not a plain file name
+    // could escape outDir.
+    std::unordered_map<std::string, size_t> names;
+    for (const auto& f : files)
+        if (!isPlainFileName(f.name) || ++names[f.name] > 1)
+            throw std::runtime_error("Corrupt manifest");
+    for (const auto& f : files)
+        if (fs::exists(fs::path(outDir) / f.name))
+            throw std::runtime_error("Output already exists");
+
+    // The chunk store is decoded to disk once, then files are assembled from it.
+    TempFile store;
+    {
+        std::ofstream storeOut(store.path, std::ios::binary);
+        if (!storeOut) throw std::runtime_error("Cannot open output");
+        in.seekg(blocksStart);
+        uint64_t storeSize = decompressBlocks(in, version, backend, snapshot.get(), storeOut, std::streamoff(manifestOffset));
+        if (storeSize != std::accumulate(chunkLens.begin(), chunkLens.end(), uint64_t(0)))
+            throw std::runtime_error("Corrupt chunk store");
+    }
+    std::ifstream storeIn(store.path, std::ios::binary);
+    std::string chunk;
+    for (const auto& f : files) {
+        std::ofstream out(fs::path(outDir) / f.name, std::ios::binary);
+        if (!out) throw std::runtime_error("Cannot open output");
+        uint64_t written = 0;
+        for (uint32_t r : f.refs) {
+            chunk.resize(chunkLens[r]);
+            storeIn.seekg(std::streamoff(chunkOffsets[r]));
+            if (!storeIn.read(&chunk[0], chunk.size()))
+                throw std::runtime_error("Corrupt chunk store");
+            out.write(chunk.data(), chunk.size());
+            written += chunk.size();
+        }
+        if (written != f.size) {
+            out.close();
+            fs::remove(fs::path(outDir) / f.name);
+            throw std::runtime_error("Corrupt manifest");
+        }
+        if (!out)
+            throw std::runtime_error("Cannot write output");
+    }
+}
+
+void Compressor::trainSnapshot(const std::vector<std::string>& samplePaths, const std::string& outPath) {
+    if (fs::exists(outPath))
+        throw std::runtime_error("Output already exists");
+
+    // Same symbols the coder sees: every sample goes through BWT/MTF/RLE in
+    // blocks and is fed to one model set, with gating off so all models learn.
+    ModelSet ms(false);
+    std::string raw;
+    for (const auto& path : samplePaths) {
+        std::ifstream fin(path, std::ios::binary);
+        if (!fin)
+            throw std::runtime_error("Cannot open input");
+        for (;;) {
+            raw.resize(BLOCK_SIZE);
+            fin.read(&raw[0], BLOCK_SIZE);
+            if (fin.bad())
+                throw std::runtime_error("Cannot read input");
+            raw.resize(size_t(fin.gcount()));
+            if (raw.empty()) break;
+            auto [bwtLast, primary] = bwtTransform(raw);
+            for (uint8_t byte : rleZero(mtfEncode(bwtLast))) {
+                for (int b = 7; b >= 0; --b) {
+                    uint16_t p1 = ms.mixer.mix();
+                    ms.updateBit(p1, (byte >> b) & 1);
+                }
+                ms.updateByte(byte);
             }
-            rle.push_back(c);
-            for (IModel* model : mods)
-                model->updateByte(c);
         }
-        auto mtf = rleZeroDecode(rle);
-        auto bwt = mtfDecode(mtf);
-        auto block = bwtInverse(bwt, primary);
-        out.write(block.data(), blockLen);
     }
-}
\ No newline at end of file
+
+    std::ostringstream state(std::ios::binary);
+    SnapshotWriter w(state);
+    ms.save(w);
+    std::string bytes = state.str();
+    uint64_t id;
+    std::memcpy(&id, hashChunk(bytes).data(), sizeof(id));
+    if (id == 0) id = 1;
+
+    std::ofstream out(outPath, std::ios::binary);
+    if (!out)
+        throw std::runtime_error("Cannot open output");
+    out.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    out.write(reinterpret_cast<const char*>(&SNAPSHOT_VERSION), sizeof(SNAPSHOT_VERSION));
+    out.write(reinterpret_cast<const char*>(&id), sizeof(id));
+    out.write(bytes.data(), bytes.size());
+    if (!out)
+        throw std::runtime_error("Cannot write output");
+}
@@ -2,11 +2,27 @@
 #define COMPRESSOR_H
 
 #include <string>
+#include <cstdint>
+#include <vector>
 
 class Compressor {
 public:
-    static void compress(const std::string& inPath, const std::string& outPath);
-    static void decompress(const std::string& inPath, const std::string& outPath);
+    // Entropy coder used for every block; recorded in the archive header.
+    enum class Backend : uint8_t {
+        ContextMixing = 0,  // best ratio, slow bitwise decode
+        Rans = 1,           // order-0 rANS, fast decode
+    };
+
+    // snapshotPath names a file from trainSnapshot that primes the models;
+    // archives record its ID and need the same snapshot to decompress.
+    // Snapshots only work with Backend::ContextMixing; rANS throws.
+    static void compress(const std::string& inPath, const std::string& outPath, Backend backend = Backend::ContextMixing,
+        const std::string& snapshotPath = {});
+    static void decompress(const std::string& inPath, const std::string& outPath, const std::string& snapshotPath = {});
+    static void compressBatch(const std::vector<std::string>& inPaths, const std::string& outPath,
+        Backend backend = Backend::ContextMixing, const std::string& snapshotPath = {});
+    static void decompressBatch(const std::string& inPath, const std::string& outDir, const std::string& snapshotPath = {});
+    static void trainSnapshot(const std::vector<std::string>& samplePaths, const std::string& outPath);
 };
 
 #endif
\ No newline at end of file
@@ -7,6 +7,9 @@
 #include <QLineEdit>
 #include <QLabel>
 #include <QProgressBar>
+#include <QCheckBox>
+#include <QDateTime>
+#include <QCoreApplication>
 #include <QVBoxLayout>
 #include <QHBoxLayout>
 #include <QFileDialog>
@@ -26,14 +29,21 @@ void FileCompressorGUI::setupUI() {
     addFileBtn = new QPushButton("Add File(s)", this);
     removeFileBtn = new QPushButton("Remove Selected", this);
     browseBtn = new QPushButton("Browse...", this);
+    snapshotBrowseBtn = new QPushButton("Browse...", this);
+    trainSnapshotBtn = new QPushButton("Train...", this);
 
     startBtn = new QPushButton("Compress / Decompress", this);
     startBtn->setFixedHeight(40);
 
     outputPathEdit = new QLineEdit(this);
     outputPathEdit->setReadOnly(true);
+    snapshotPathEdit = new QLineEdit(this);
+    snapshotPathEdit->setReadOnly(true);
+    snapshotPathEdit->setPlaceholderText("None");
     progressBar = new QProgressBar(this);
     statusLabel = new QLabel("Status: Idle", this);
+    dedupCheck = new QCheckBox("Pack into one deduplicated archive (.srb)", this);
+    fastDecodeCheck = new QCheckBox("Fast decompression (rANS, lower ratio on some data)", this);
 
     auto* fileBtns = new QHBoxLayout;
     fileBtns->addWidget(addFileBtn);
@@ -43,12 +53,21 @@ void FileCompressorGUI::setupUI() {
     outputDirLayout->addWidget(outputPathEdit);
     outputDirLayout->addWidget(browseBtn);
 
+    auto* snapshotLayout = new QHBoxLayout;
+    snapshotLayout->addWidget(snapshotPathEdit);
+    snapshotLayout->addWidget(snapshotBrowseBtn);
+    snapshotLayout->addWidget(trainSnapshotBtn);
+
     auto* mainLayout = new QVBoxLayout;
     mainLayout->addWidget(new QLabel("Selected File(s):"));
     mainLayout->addWidget(dragAndDropList);
     mainLayout->addLayout(fileBtns);
     mainLayout->addWidget(new QLabel("Output Directory:"));
     mainLayout->addLayout(outputDirLayout);
+    mainLayout->addWidget(new QLabel("Model Snapshot:"));
+    mainLayout->addLayout(snapshotLayout);
+    mainLayout->addWidget(dedupCheck);
+    mainLayout->addWidget(fastDecodeCheck);
     mainLayout->addWidget(startBtn);
     mainLayout->addWidget(progressBar);
     mainLayout->addWidget(statusLabel);
@@ -61,6 +80,8 @@ void FileCompressorGUI::setupUI() {
     connect(addFileBtn, &QPushButton::clicked, this, &FileCompressorGUI::addFiles);
     connect(removeFileBtn, &QPushButton::clicked, this, &FileCompressorGUI::removeSelectedFiles);
     connect(browseBtn, &QPushButton::clicked, this, &FileCompressorGUI::chooseOutputDirectory);
+    connect(snapshotBrowseBtn, &QPushButton::clicked, this, &FileCompressorGUI::chooseSnapshot);
+    connect(trainSnapshotBtn, &QPushButton::clicked, this, &FileCompressorGUI::trainSnapshot);
     connect(startBtn, &QPushButton::clicked, this, &FileCompressorGUI::startCompression);
 }
 
@@ -80,6 +101,37 @@ void FileCompressorGUI::chooseOutputDirectory() {
     }
 }
 
+void FileCompressorGUI::chooseSnapshot() {
+    QString file = QFileDialog::getOpenFileName(this, "Select Model Snapshot", QString(), "Model snapshots (*.zbs)");
+    snapshotPathEdit->setText(file);
+}
+
+void FileCompressorGUI::trainSnapshot() {
+    QStringList samples = QFileDialog::getOpenFileNames(this, "Select Sample Files");
+    if (samples.isEmpty())
+        return;
+    QString file = QFileDialog::getSaveFileName(this, "Save Model Snapshot", QString(), "Model snapshots (*.zbs)");
+    if (file.isEmpty())
+        return;
+
+    std::vector<std::string> paths;
+    for (const QString& s : samples)
+        paths.push_back(s.toStdString());
+
+    statusLabel->setText("Status: Training snapshot...");
+    try {
+        Compressor::trainSnapshot(paths, file.toStdString());
+    }
+    catch (const std::exception& e) {
+        QMessageBox::critical(this, "Training Error", QString("Failed to train %1: %2")
+            .arg(file, e.what()));
+        statusLabel->setText("Status: Failed!");
+        return;
+    }
+    snapshotPathEdit->setText(file);
+    statusLabel->setText("Status: Snapshot saved");
+}
+
 void FileCompressorGUI::startCompression() {
     if (dragAndDropList->count() == 0 || outputPathEdit->text().isEmpty()) {
         QMessageBox::warning(this, "Input Error", "Please select files and output directory.");
@@ -93,9 +145,26 @@ void FileCompressorGUI::startCompression() {
         return;
     }
 
+    if (fastDecodeCheck->isChecked() && !snapshotPathEdit->text().isEmpty()) {
+        for (int i = 0; i < dragAndDropList->count(); ++i) {
+            QString suffix = QFileInfo(dragAndDropList->item(i)->text()).suffix().toLower();
+            if (suffix != "srr" && suffix != "srb") {
+                QMessageBox::warning(this, "Input Error",
+                    "Model snapshots only work without fast decompression. Clear the snapshot or untick fast decompression.");
+                return;
+            }
+        }
+    }
+
     statusLabel->setText("Status: Compressiong...");
     progressBar->setValue(0);
     int fileCount = dragAndDropList->count();
+    std::vector<std::string> batch;
+    Compressor::Backend backend = fastDecodeCheck->isChecked()
+        ? Compressor::Backend::Rans
+        : Compressor::Backend::ContextMixing;
+    std::string snapshot = snapshotPathEdit->text().toStdString();
+    int done = 0;
 
     for (int i = 0; i < fileCount; ++i) {
         QListWidgetItem* item = dragAndDropList->item(i);
@@ -105,16 +174,23 @@ void FileCompressorGUI::startCompression() {
         try {
             QString outputFilePath;
 
-            if (inputInfo.suffix().toLower() == "srr") {
+            if (inputInfo.suffix().toLower() == "srb") {
+                Compressor::decompressBatch(inputFilePath.toStdString(), outputDir.toStdString(), snapshot);
+            }
+            else if (inputInfo.suffix().toLower() == "srr") {
                 QString originalName = inputInfo.fileName();
                 originalName.chop(4);  
                 outputFilePath = dir.filePath(originalName);
-                Compressor::decompress(inputFilePath.toStdString(), outputFilePath.toStdString());
+                Compressor::decompress(inputFilePath.toStdString(), outputFilePath.toStdString(), snapshot);
+            }
+            else if (dedupCheck->isChecked()) {
+                batch.push_back(inputFilePath.toStdString());
+                continue;
             }
             else {
                 QString ext = inputInfo.suffix().toLower();
                 outputFilePath = dir.filePath(inputInfo.fileName() + ".srr");  
-                Compressor::compress(inputFilePath.toStdString(), outputFilePath.toStdString());
+                Compressor::compress(inputFilePath.toStdString(), outputFilePath.toStdString(), backend, snapshot);
             }
         }
         catch (const std::exception& e) {
@@ -124,6 +200,27 @@ void FileCompressorGUI::startCompression() {
             return;
         }
 
-        progressBar->setValue((i + 1) * 100 / fileCount);
+        progressBar->setValue(++done * 100 / fileCount);
+    }
+
+    if (!batch.empty()) {
+        QString stamp = QDateTime::currentDateTime().toString("yyyyMMdd-HHmmss");
+        QString archivePath = dir.filePath(stamp + ".srb");
+        for (int n = 2; QFileInfo::exists(archivePath); ++n)
+            archivePath = dir.filePath(QString("%1-%2.srb").arg(stamp).arg(n));
+
+        statusLabel->setText(QString("Status: Packing %1 file(s) into %2...")
+            .arg(int(batch.size())).arg(QFileInfo(archivePath).fileName()));
+        QCoreApplication::processEvents();
+        try {
+            Compressor::compressBatch(batch, archivePath.toStdString(), backend, snapshot);
+        }
+        catch (const std::exception& e) {
+            QMessageBox::critical(this, "Compression Error", QString("Failed to create %1: %2")
+                .arg(archivePath, e.what()));
+            statusLabel->setText("Status: Failed!");
+            return;
+        }
+        progressBar->setValue(100);
     }
 }
\ No newline at end of file
@@ -11,6 +11,7 @@ class QLineEdit;
 class QPushButton;
 class QProgressBar;
 class QLabel;
+class QCheckBox;
 
 class FileCompressorGUI : public QMainWindow {
     Q_OBJECT
@@ -22,16 +23,23 @@ private slots:
     void addFiles();
     void removeSelectedFiles();
     void chooseOutputDirectory();
+    void chooseSnapshot();
+    void trainSnapshot();
     void startCompression();
 
 private:
     DragAndDropList* dragAndDropList;
     QLineEdit* outputPathEdit;
+    QLineEdit* snapshotPathEdit;
     QProgressBar* progressBar;
     QLabel* statusLabel;
+    QCheckBox* dedupCheck;
+    QCheckBox* fastDecodeCheck;
     QPushButton* addFileBtn;
     QPushButton* removeFileBtn;
     QPushButton* browseBtn;
+    QPushButton* snapshotBrowseBtn;
+    QPushButton* trainSnapshotBtn;
     QPushButton* startBtn;
 
    void setupUI();